@@ -2,7 +2,13 @@
 #include <cstdio>
 #include <cassert>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
 
 using std::uint32_t;
 using std::uint64_t;
@@ -153,15 +159,28 @@ observation compute_observation(const point &point, const char *const map, direc
     return ret;
 }
 
-template<typename PRNG> void perturb_observation(observation &observation, PRNG *rng) {
+enum direction_noise {
+    NOISE_NONE,
+    NOISE_BACKWARDS,
+    NOISE_SIDEWAYS,
+};
+
+// which perturbations fired, so they can be logged with the rest of the step
+struct perturbation {
+    direction_noise dir_noise;
+    bool sensor_flipped[NUM_DIRECTIONS];
+};
+
+template<typename PRNG> perturbation perturb_observation(observation &observation, PRNG *rng) {
+    perturbation ret = {NOISE_NONE, {false}};
     uint32_t rand = next_rand(rng);
     static_assert(NUM_DIRECTIONS == 4, "NUM_DIRECTIONS must equal 4"); // we use bit stuff
     if (rand < DIR_NOISE_CHANCE) {
         if (rand < DIR_BACK_CHANCE) {
-            std::printf("perturbing direction backwards\n");
+            ret.dir_noise = NOISE_BACKWARDS;
             observation.direction = (direction)((size_t)observation.direction ^ 2);
         } else {
-            std::printf("perturbing direction sideways\n");
+            ret.dir_noise = NOISE_SIDEWAYS;
             observation.direction = (direction)((size_t)observation.direction ^ 1);
             if (rand & 1) observation.direction = (direction)((size_t)observation.direction ^ 2);;
         }
@@ -169,14 +188,44 @@ template<typename PRNG> void perturb_observation(observation &observation, PRNG
     for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
         uint32_t rand = next_rand(rng);
         if (rand < SENSOR_NOISE_CHANCE) {
-            std::printf("perturbing sensor %s\n", dbg_dir_strings[dir]);
+            ret.sensor_flipped[dir] = true;
             observation.sensor[dir] = !observation.sensor[dir];
         }
     }
+    return ret;
 }
 
+void dbg_print_perturbation(const perturbation &noise) {
+    if (noise.dir_noise == NOISE_BACKWARDS) std::printf("perturbing direction backwards\n");
+    if (noise.dir_noise == NOISE_SIDEWAYS) std::printf("perturbing direction sideways\n");
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        if (noise.sensor_flipped[dir]) std::printf("perturbing sensor %s\n", dbg_dir_strings[dir]);
+    }
+}
+
+// most likely cells are tracked while normalizing, so nobody has to rescan the belief.
+// this is also the largest k most_likely_cells() accepts
+constexpr size_t TOP_K = 5;
+constexpr size_t TILE_SIZE = WIDTH; // one row per tile
+
+struct belief_cell {
+    size_t index;
+    uint32_t probability;
+};
+
+struct belief_summary {
+    uint32_t maxprob;
+    size_t maxlocn; // number of cells tied at maxprob
+    size_t topn;
+    belief_cell top[TOP_K]; // most likely first, ties in index order
+    uint64_t top_mass; // sum of top[].probability
+    size_t support; // number of nonzero cells
+    unsigned short active[WIDTH * HEIGHT]; // the nonzero cells, in index order
+};
+
 struct locator {
     uint32_t probability[WIDTH * HEIGHT];
+    belief_summary summary;
 };
 
 const point &next_point(point &pt) {
@@ -214,46 +263,203 @@ uint32_t observation_probability(const observation &from, const observation &to)
     return (uint32_t)ret;
 }
 
-void normalize_probabilities(uint32_t *arr, size_t size) {
+// strict ordering used for top-k: higher probability first, then lower index
+inline bool more_likely(const belief_cell &a, const belief_cell &b) {
+    return a.probability > b.probability || (a.probability == b.probability && a.index < b.index);
+}
+
+// top[] is kept as a heap with the least likely cell at the front until finish_summary()
+void offer_cell(belief_summary *summary, const belief_cell &cell) {
+    belief_cell *top = summary->top;
+    if (summary->topn < TOP_K) {
+        top[summary->topn++] = cell;
+        std::push_heap(top, top + summary->topn, more_likely);
+    } else if (more_likely(cell, top[0])) {
+        std::pop_heap(top, top + TOP_K, more_likely);
+        top[TOP_K - 1] = cell;
+        std::push_heap(top, top + TOP_K, more_likely);
+    }
+}
+
+void finish_summary(belief_summary *summary) {
+    std::sort_heap(summary->top, summary->top + summary->topn, more_likely);
+    summary->top_mass = 0;
+    for (size_t i = 0; i < summary->topn; i++) summary->top_mass += summary->top[i].probability;
+}
+
+// normalizes in place and fills in the summary in the same pass
+// sums, if given, receives the total before and after normalizing
+void normalize_probabilities(uint32_t *arr, size_t size, belief_summary *summary, uint64_t *sums) {
     uint64_t sum_prob = 0;
     for (size_t i = 0; i < size; i++) sum_prob += arr[i];
-    std::printf("sum prob: %llu\n", sum_prob);
-    std::fflush(stdout);
-    for (size_t i = 0; i < size; i++) {
-        if (arr[i] == sum_prob) arr[i] = (uint32_t)(((uint64_t)1 << 32) - 1);
-        else arr[i] = (uint32_t)(((uint64_t)arr[i] << 32) / sum_prob);
+    summary->maxprob = 0;
+    summary->maxlocn = 0;
+    summary->topn = 0;
+    summary->support = 0;
+    uint64_t new_sum = 0;
+    for (size_t tile = 0; tile < size; tile += TILE_SIZE) {
+        size_t tile_end = tile + TILE_SIZE < size ? tile + TILE_SIZE : size;
+        uint32_t tile_max = 0;
+        size_t tile_maxn = 0;
+        for (size_t i = tile; i < tile_end; i++) {
+            if (arr[i] == sum_prob) arr[i] = (uint32_t)(((uint64_t)1 << 32) - 1);
+            else arr[i] = (uint32_t)(((uint64_t)arr[i] << 32) / sum_prob);
+            new_sum += arr[i];
+            if (arr[i]) summary->active[summary->support++] = (unsigned short)i;
+            if (arr[i] > tile_max) {
+                tile_max = arr[i];
+                tile_maxn = 1;
+            } else if (arr[i] == tile_max) {
+                tile_maxn++;
+            }
+        }
+        if (tile_max > summary->maxprob) {
+            summary->maxprob = tile_max;
+            summary->maxlocn = tile_maxn;
+        } else if (tile_max == summary->maxprob) {
+            summary->maxlocn += tile_maxn;
+        }
+        // later cells lose ties, so a tile that can't beat the current k-th cell is skipped
+        if (summary->topn == TOP_K && tile_max <= summary->top[0].probability) continue;
+        for (size_t i = tile; i < tile_end; i++) offer_cell(summary, {i, arr[i]});
+    }
+    finish_summary(summary);
+    if (sums) {
+        sums[0] = sum_prob;
+        sums[1] = new_sum;
     }
-    sum_prob = 0;
-    for (size_t i = 0; i < size; i++) sum_prob += arr[i];
-    std::printf("sum prob: %llu\n", sum_prob);
-    std::fflush(stdout);
 }
 
-locator update_locator(const locator &src_locator, const char *map, const observation &observation) {
-    locator ret = {{0}};
+// writes the k most likely cells to cells and their total probability to mass (if given).
+// k must be at most TOP_K, since only that many are tracked; the return value is k, or
+// fewer if the map has fewer than k free cells
+size_t most_likely_cells(const locator &loc, size_t k, belief_cell *cells, uint64_t *mass) {
+    assert(k <= TOP_K && "most_likely_cells() only tracks TOP_K cells");
+    const belief_summary &summary = loc.summary;
+    if (k >= summary.topn) {
+        k = summary.topn;
+        if (mass) *mass = summary.top_mass;
+    } else if (mass) {
+        *mass = 0;
+        for (size_t i = 0; i < k; i++) *mass += summary.top[i].probability;
+    }
+    std::copy(summary.top, summary.top + k, cells);
+    return k;
+}
+
+enum kernel_strategy {
+    KERNEL_DENSE,    // sweep every free cell
+    KERNEL_SPARSE,   // only cells in the belief's active set
+    KERNEL_THREADED, // dense, with rows split across threads
+    NUM_KERNELS,
+};
+
+const char *const kernel_strings[NUM_KERNELS] = {"dense", "sparse", "threaded"};
+
+size_t num_free_neighbors(const point &pt, const char *map) {
+    size_t num_free = 0;
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        if (is_dir_free(pt, map, (direction)dir)) num_free++;
+    }
+    return num_free;
+}
+
+// spread the probability of one cell over its neighbors
+inline void scatter_cell(const point &pt, uint32_t src_prob, const char *map, const observation &observation, uint32_t *out) {
     uint32_t dir_probs[NUM_DIRECTIONS];
+    size_t num_prob = 0; // number of possible directions to move (calculate probability of transition)
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        point np = move_point(pt, (direction) dir);
+        if (is_invalid(np) || is_wall(np, map)) {
+            dir_probs[dir] = 0;
+        } else {
+            dir_probs[dir] = observation_probability(compute_observation(np, map, (direction) dir), observation);
+            num_prob++;
+        }
+    }
+    if (num_prob == 0) return;
+    for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
+        point np = move_point(pt, (direction)dir);
+        uint64_t moveprob = ((((uint64_t)dir_probs[dir] * src_prob) / num_prob) >> 32);
+        uint64_t newprob = out[point_index(np)] + moveprob;
+        if (newprob >= ((uint64_t)1 << 32)) newprob = ((uint64_t)1 << 32) - 1;
+        out[point_index(np)] = (uint32_t)newprob;
+    }
+}
+
+// out must be zeroed
+void transition_dense(const locator &src_locator, const char *map, const observation &observation, uint32_t *out) {
     for (point pt = {{0}}; pt.p[1] < HEIGHT; next_point(pt)) {
         if (is_wall(pt, map)) continue;
-        size_t num_prob = 0; // number of possible directions to move (calculate probability of transition)
-        for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-            point np = move_point(pt, (direction) dir);
-            if (is_invalid(np) || is_wall(np, map)) {
-                dir_probs[dir] = 0;
-            } else {
-                dir_probs[dir] = observation_probability(compute_observation(np, map, (direction) dir), observation);
-                num_prob++;
-            }
-        }
-        if (num_prob == 0) continue;
+        scatter_cell(pt, src_locator.probability[point_index(pt)], map, observation, out);
+    }
+}
+
+// out must be zeroed; zero cells contribute nothing, so this matches transition_dense exactly
+void transition_sparse(const locator &src_locator, const char *map, const observation &observation, uint32_t *out) {
+    const belief_summary &summary = src_locator.summary;
+    for (size_t i = 0; i < summary.support; i++) {
+        point pt = from_index(summary.active[i]);
+        if (is_wall(pt, map)) continue;
+        scatter_cell(pt, src_locator.probability[summary.active[i]], map, observation, out);
+    }
+}
+
+// pulls from the neighbors of every cell in rows [row_begin, row_end), so rows can be split between threads.
+// the sum is saturated once at the end, which gives the same result as saturating after every add in scatter_cell
+void gather_rows(const locator &src_locator, const char *map, const observation &observation, uint32_t *out, int row_begin, int row_end) {
+    static_assert(NUM_DIRECTIONS == 4, "NUM_DIRECTIONS must equal 4"); // opposite direction is dir ^ 2
+    for (point np = {{0, row_begin}}; np.p[1] < row_end; next_point(np)) {
+        if (is_wall(np, map)) continue;
+        uint64_t newprob = 0;
         for (int dir = 0; dir < NUM_DIRECTIONS; dir++) {
-            point np = move_point(pt, (direction)dir);
-            uint64_t moveprob = ((((uint64_t)dir_probs[dir] * src_locator.probability[point_index(pt)]) / num_prob) >> 32);
-            uint64_t newprob = ret.probability[point_index(np)] + moveprob;
-            if (newprob >= ((uint64_t)1 << 32)) newprob = ((uint64_t)1 << 32) - 1;
-            ret.probability[point_index(np)] = (uint32_t)newprob;
+            point pt = move_point(np, (direction)(dir ^ 2)); // moving dir from pt lands on np
+            if (is_invalid(pt) || is_wall(pt, map)) continue;
+            uint32_t src_prob = src_locator.probability[point_index(pt)];
+            if (src_prob == 0) continue;
+            uint64_t dir_prob = observation_probability(compute_observation(np, map, (direction) dir), observation);
+            newprob += ((dir_prob * src_prob) / num_free_neighbors(pt, map)) >> 32;
         }
+        if (newprob >= ((uint64_t)1 << 32)) newprob = ((uint64_t)1 << 32) - 1;
+        out[point_index(np)] = (uint32_t)newprob;
     }
-    normalize_probabilities(ret.probability, WIDTH * HEIGHT);
+}
+
+void transition_threaded(const locator &src_locator, const char *map, const observation &observation, uint32_t *out, unsigned num_threads) {
+    if (num_threads > HEIGHT) num_threads = HEIGHT;
+    if (num_threads < 1) num_threads = 1;
+    std::thread workers[HEIGHT];
+    int row = 0;
+    for (unsigned t = 0; t < num_threads; t++) {
+        int row_end = (int)(HEIGHT * (t + 1) / num_threads);
+        // the calling thread takes the last band
+        if (t + 1 == num_threads) gather_rows(src_locator, map, observation, out, row, row_end);
+        else workers[t] = std::thread(gather_rows, std::cref(src_locator), map, std::cref(observation), out, row, row_end);
+        row = row_end;
+    }
+    for (unsigned t = 0; t + 1 < num_threads; t++) workers[t].join();
+}
+
+void run_transition(kernel_strategy strategy, const locator &src_locator, const char *map, const observation &observation, uint32_t *out, unsigned num_threads) {
+    switch (strategy) {
+    case KERNEL_SPARSE:
+        transition_sparse(src_locator, map, observation, out);
+        break;
+    case KERNEL_THREADED:
+        transition_threaded(src_locator, map, observation, out, num_threads);
+        break;
+    case KERNEL_DENSE:
+    case NUM_KERNELS:
+        transition_dense(src_locator, map, observation, out);
+        break;
+    }
+}
+
+// KERNEL_SPARSE needs src_locator.summary to be filled in
+locator update_locator(const locator &src_locator, const char *map, const observation &observation, kernel_strategy strategy = KERNEL_DENSE, unsigned num_threads = 1, uint64_t *sum_prob = nullptr) {
+    locator ret = {{0}};
+    run_transition(strategy, src_locator, map, observation, ret.probability, num_threads);
+    normalize_probabilities(ret.probability, WIDTH * HEIGHT, &ret.summary, sum_prob);
     return ret;
 }
 
@@ -276,79 +482,362 @@ void write_observation(std::ofstream &out_json, const char *field_name, const ob
     out_json << "},";
 }
 
-int main(int argc, char **argv) {
-    locator loc = {{0}};
-    size_t nspaces = 0;
-    for (size_t a = 0; a < WIDTH * HEIGHT; a++) if (!is_wall(from_index(a), map)) nspaces++;
-    uint32_t prob = ((uint64_t)1 << 32) / nspaces;
-    for (size_t a = 0; a < WIDTH * HEIGHT; a++) loc.probability[a] = prob;
+// single-producer single-consumer ring buffer; N must be a power of two
+template<typename T, size_t N> struct spsc_ring {
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+    alignas(64) std::atomic<size_t> head; // next slot to read, only advanced by the consumer
+    alignas(64) std::atomic<size_t> tail; // next slot to write, only advanced by the producer
+    T slots[N];
+};
+
+template<typename T, size_t N> void ring_init(spsc_ring<T, N> *ring) {
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+}
+
+template<typename T, size_t N> bool ring_try_push(spsc_ring<T, N> *ring, const T &item) {
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) == N) return false;
+    ring->slots[tail & (N - 1)] = item;
+    ring->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T, size_t N> bool ring_try_pop(spsc_ring<T, N> *ring, T &item) {
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if (head == ring->tail.load(std::memory_order_acquire)) return false;
+    item = ring->slots[head & (N - 1)];
+    ring->head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+typedef std::chrono::steady_clock pipeline_clock;
+
+inline uint64_t elapsed_ns(pipeline_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(pipeline_clock::now() - since).count();
+}
+
+// per-stage timing; busy time is whatever is left after waiting on either ring
+struct stage_stats {
+    const char *name;
+    size_t items;
+    uint64_t total_ns;
+    uint64_t starved_ns; // waiting for input
+    uint64_t blocked_ns; // waiting for room in the output ring (backpressure)
+};
+
+// blocks (yielding) until the consumer makes room
+template<typename T, size_t N> void ring_push(spsc_ring<T, N> *ring, const T &item, stage_stats *stats) {
+    if (ring_try_push(ring, item)) return;
+    auto start = pipeline_clock::now();
+    while (!ring_try_push(ring, item)) std::this_thread::yield();
+    stats->blocked_ns += elapsed_ns(start);
+}
+
+// blocks (yielding) until the producer delivers
+template<typename T, size_t N> void ring_pop(spsc_ring<T, N> *ring, T &item, stage_stats *stats) {
+    if (ring_try_pop(ring, item)) return;
+    auto start = pipeline_clock::now();
+    while (!ring_try_pop(ring, item)) std::this_thread::yield();
+    stats->starved_ns += elapsed_ns(start);
+}
+
+void print_stage_stats(const stage_stats *stats, size_t num_stages) {
+    // slowest stage by busy throughput; a stage that did no measurable work can't be the bottleneck
+    const stage_stats *bottleneck = nullptr;
+    double bottleneck_rate = 0.0;
+    for (size_t i = 0; i < num_stages; i++) {
+        const stage_stats &st = stats[i];
+        uint64_t busy_ns = st.total_ns - st.starved_ns - st.blocked_ns;
+        double rate = busy_ns ? st.items * 1e9 / busy_ns : 0.0;
+        std::fprintf(stderr, "%-8s %6zu items  total %9.3f ms  busy %9.3f ms  starved %9.3f ms  blocked %9.3f ms  %12.1f items/s busy\n",
+            st.name, st.items, st.total_ns / 1e6, busy_ns / 1e6, st.starved_ns / 1e6, st.blocked_ns / 1e6, rate);
+        if (busy_ns && (!bottleneck || rate < bottleneck_rate)) {
+            bottleneck = &st;
+            bottleneck_rate = rate;
+        }
+    }
+    if (bottleneck) std::fprintf(stderr, "bottleneck: %s\n", bottleneck->name);
+}
+
+// picks an update kernel per step from the map and the current belief
+
+struct kernel_thresholds {
+    size_t sparse_max_support; // use the active set while at most this many cells are nonzero
+    size_t threaded_min_cells; // split the sweep across threads from this many free cells up
+};
+
+const char *const CALIBRATION_FILE = "robotloc_calibration.txt";
+
+// used when there is no calibration file; threading never pays off on maps this small
+const kernel_thresholds DEFAULT_THRESHOLDS = {(WIDTH * HEIGHT) / 4, (size_t)1 << 16};
+
+struct kernel_planner {
+    kernel_thresholds thresholds;
+    size_t free_cells;
+    unsigned cores;
+    size_t chosen[NUM_KERNELS];
+};
+
+void planner_init(kernel_planner *planner, const char *map, const kernel_thresholds &thresholds) {
+    planner->thresholds = thresholds;
+    planner->free_cells = 0;
+    for (size_t a = 0; a < WIDTH * HEIGHT; a++) if (!is_wall(from_index(a), map)) planner->free_cells++;
+    planner->cores = std::thread::hardware_concurrency();
+    if (planner->cores == 0) planner->cores = 1;
+    for (size_t k = 0; k < NUM_KERNELS; k++) planner->chosen[k] = 0;
+}
+
+kernel_strategy plan_update(const kernel_planner &planner, const locator &src_locator) {
+    if (src_locator.summary.support <= planner.thresholds.sparse_max_support) return KERNEL_SPARSE;
+    if (planner.cores > 1 && planner.free_cells >= planner.thresholds.threaded_min_cells) return KERNEL_THREADED;
+    return KERNEL_DENSE;
+}
+
+locator planned_update(kernel_planner *planner, const locator &src_locator, const char *map, const observation &observation, uint64_t *sum_prob) {
+    kernel_strategy strategy = plan_update(*planner, src_locator);
+    planner->chosen[strategy]++;
+    return update_locator(src_locator, map, observation, strategy, planner->cores, sum_prob);
+}
+
+void print_planner_stats(const kernel_planner &planner) {
+    std::fprintf(stderr, "kernels (%zu free cells, %u cores, sparse <= %zu nonzero, threaded >= %zu free):",
+        planner.free_cells, planner.cores, planner.thresholds.sparse_max_support, planner.thresholds.threaded_min_cells);
+    for (size_t k = 0; k < NUM_KERNELS; k++) std::fprintf(stderr, " %s %zu", kernel_strings[k], planner.chosen[k]);
+    std::fprintf(stderr, "\n");
+}
+
+bool load_thresholds(kernel_thresholds *thresholds) {
+    std::ifstream in(CALIBRATION_FILE);
+    kernel_thresholds loaded;
+    if (!(in >> loaded.sparse_max_support >> loaded.threaded_min_cells)) return false;
+    *thresholds = loaded;
+    return true;
+}
+
+// nanoseconds per call of one transition kernel, best of a few rounds
+uint64_t time_transition(kernel_strategy strategy, const locator &src_locator, const char *map, const observation &observation, unsigned num_threads) {
+    const size_t rounds = 5, reps = strategy == KERNEL_THREADED ? 20 : 200;
+    static uint32_t out[WIDTH * HEIGHT];
+    uint64_t best = UINT64_MAX;
+    for (size_t r = 0; r < rounds; r++) {
+        auto start = pipeline_clock::now();
+        for (size_t i = 0; i < reps; i++) {
+            std::fill(out, out + WIDTH * HEIGHT, 0);
+            run_transition(strategy, src_locator, map, observation, out, num_threads);
+        }
+        uint64_t ns = elapsed_ns(start) / reps;
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+// measures the crossovers on this host and writes them to CALIBRATION_FILE
+kernel_thresholds calibrate(const kernel_planner &planner, const char *map) {
+    kernel_thresholds thresholds = DEFAULT_THRESHOLDS;
+    size_t free_index[WIDTH * HEIGHT];
+    size_t num_free = 0;
+    for (size_t a = 0; a < WIDTH * HEIGHT; a++) if (!is_wall(from_index(a), map)) free_index[num_free++] = a;
+    observation obs = compute_observation(from_index(free_index[0]), map, EAST);
+    // sparse vs dense: try every support (spread evenly over the free cells) and keep the largest one
+    // where the active set still wins, so one noisy sample can't cut the search short
+    static locator loc;
+    thresholds.sparse_max_support = 0;
+    for (size_t support = 1; support <= num_free; support++) {
+        loc = locator();
+        for (size_t i = 0; i < support; i++) {
+            size_t a = free_index[i * num_free / support];
+            loc.probability[a] = (uint32_t)(((uint64_t)1 << 32) / support);
+            loc.summary.active[i] = (unsigned short)a;
+        }
+        loc.summary.support = support;
+        uint64_t dense_ns = time_transition(KERNEL_DENSE, loc, map, obs, 1);
+        uint64_t sparse_ns = time_transition(KERNEL_SPARSE, loc, map, obs, 1);
+        if (sparse_ns <= dense_ns) thresholds.sparse_max_support = support;
+    }
+    // threaded vs dense: the sweep costs dense_per_cell * free cells. the threaded kernel gathers instead,
+    // which costs gather_per_cell * free cells split over the threads plus a fixed overhead for starting
+    // them, so it wins above overhead / (dense_per_cell - gather_per_cell / threads) free cells
+    if (planner.cores > 1) {
+        for (size_t i = 0; i < num_free; i++) loc.probability[free_index[i]] = (uint32_t)(((uint64_t)1 << 32) / num_free);
+        double dense_ns = (double)time_transition(KERNEL_DENSE, loc, map, obs, 1);
+        double gather_ns = (double)time_transition(KERNEL_THREADED, loc, map, obs, 1); // runs inline, no threads
+        double threaded_ns = (double)time_transition(KERNEL_THREADED, loc, map, obs, planner.cores);
+        unsigned threads = planner.cores < HEIGHT ? planner.cores : HEIGHT;
+        double dense_per_cell_ns = dense_ns / num_free;
+        double gather_per_cell_ns = gather_ns / num_free;
+        double overhead_ns = threaded_ns - gather_ns / threads;
+        if (overhead_ns < 0) overhead_ns = 0;
+        double saved_per_cell_ns = dense_per_cell_ns - gather_per_cell_ns / threads;
+        if (saved_per_cell_ns <= 0) thresholds.threaded_min_cells = SIZE_MAX;
+        else thresholds.threaded_min_cells = (size_t)(overhead_ns / saved_per_cell_ns) + 1;
+        std::fprintf(stderr, "dense %.1f ns/cell, gather %.1f ns/cell, threaded x%u overhead %.0f ns\n",
+            dense_per_cell_ns, gather_per_cell_ns, threads, overhead_ns);
+    } else {
+        thresholds.threaded_min_cells = SIZE_MAX;
+    }
+    std::fprintf(stderr, "sparse <= %zu nonzero cells, threaded >= %zu free cells\n",
+        thresholds.sparse_max_support, thresholds.threaded_min_cells);
+    std::ofstream out(CALIBRATION_FILE);
+    out << thresholds.sparse_max_support << " " << thresholds.threaded_min_cells << "\n";
+    return thresholds;
+}
+
+// pipeline stages: simulate -> filter -> serialize
+
+constexpr size_t PIPELINE_DEPTH = 16;
+
+struct sim_step {
+    size_t index;
+    bool done; // end of stream marker, nothing else is valid
+    point location;
+    observation obs_real;
+    observation obs_observed;
+    direction move_dir;
+    perturbation noise;
+};
+
+struct belief_step {
+    sim_step sim;
+    locator loc;
+    uint64_t sum_prob[2]; // before and after normalizing
+};
+
+void simulate_stage(size_t num_movements, spsc_ring<sim_step, PIPELINE_DEPTH> *out, stage_stats *stats) {
+    auto start = pipeline_clock::now();
     point pt = {{0, 0}};
     if (is_wall(pt, map)) pt.p[0] = pt.p[1] = 1;
-    std::printf("probability: %.12f\n", loc.probability[0] / (double)((uint64_t)1 << 32));
-    std::fflush(stdout);
-    // direction movements[] = {EAST, EAST, EAST, EAST, EAST, SOUTH, SOUTH, WEST, WEST, WEST, SOUTH, WEST, WEST, NORTH};
-    size_t num_movements = 100;
     // rng
     bb_rand_ctx prng;
     bb_rand_init(&prng, 0xDEADBEEF);
+    for (size_t index = 0; index < num_movements; index++) {
+        sim_step step;
+        step.index = index;
+        step.done = false;
+        direction move_dir = move_randomly(pt, map, &prng);
+        // move around
+        pt = move_point(pt, move_dir);
+        assert(!is_invalid(pt) && !is_wall(pt, map));
+        step.location = pt;
+        step.move_dir = move_dir;
+        step.obs_real = compute_observation(pt, map, move_dir);
+        step.obs_observed = step.obs_real;
+        step.noise = perturb_observation(step.obs_observed, &prng);
+        ring_push(out, step, stats);
+        stats->items++;
+    }
+    sim_step end = {num_movements, true};
+    ring_push(out, end, stats);
+    stats->total_ns = elapsed_ns(start);
+}
+
+void filter_stage(kernel_planner *planner, const locator &initial, spsc_ring<sim_step, PIPELINE_DEPTH> *in, spsc_ring<belief_step, PIPELINE_DEPTH> *out, stage_stats *stats) {
+    auto start = pipeline_clock::now();
+    belief_step step;
+    step.loc = initial;
+    for (;;) {
+        ring_pop(in, step.sim, stats);
+        if (step.sim.done) break;
+        step.loc = planned_update(planner, step.loc, map, step.sim.obs_observed, step.sum_prob);
+        ring_push(out, step, stats);
+        stats->items++;
+    }
+    ring_push(out, step, stats);
+    stats->total_ns = elapsed_ns(start);
+}
+
+void serialize_stage(std::ofstream &out_json, spsc_ring<belief_step, PIPELINE_DEPTH> *in, stage_stats *stats) {
+    auto start = pipeline_clock::now();
     // log movements and probabilities
-    std::ofstream out_json("robot.json");
     out_json << "{\"width\":" << WIDTH << ",\"height\":" << HEIGHT << ",\"map\":[";
     for (size_t q = 0; q < WIDTH * HEIGHT; q++) {
         if (q) out_json << ",";
         out_json << is_wall(from_index(q), map);
     }
     out_json << "],\"data\":[";
-    for (size_t index = 0; index < num_movements; index++) {
-        if (index) out_json << ",";
-        direction move_dir = move_randomly(pt, map, &prng);
+    belief_step step;
+    for (;;) {
+        ring_pop(in, step, stats);
+        if (step.sim.done) break;
+        // all of a step's log lines are printed here, so they stay together
+        std::printf("||> MOVEMENT %llu: %s\n", step.sim.index + 1, dbg_dir_strings[step.sim.move_dir]);
+        dbg_print_perturbation(step.sim.noise);
+        dbg_print_observation(step.sim.obs_observed);
+        std::printf("sum prob: %llu\n", step.sum_prob[0]);
+        std::printf("sum prob: %llu\n", step.sum_prob[1]);
+        const point &pt = step.sim.location;
+        const locator &loc = step.loc;
+        if (step.sim.index) out_json << ",";
         out_json << "{";
-        std::printf("||> MOVEMENT %llu: %s\n", index + 1, dbg_dir_strings[move_dir]);
-        std::fflush(stdout);
-        // move around
-        pt = move_point(pt, move_dir);
         out_json << "\"location\":[" << pt.p[0] << "," << pt.p[1] << "],";
-        assert(!is_invalid(pt) && !is_wall(pt, map));
-        observation obs = compute_observation(pt, map, move_dir);
-        write_observation(out_json, "obs_real", obs);
-        perturb_observation(obs, &prng);
-        write_observation(out_json, "obs_observed", obs);
-        dbg_print_observation(obs);
-        loc = update_locator(loc, map, obs);
-        size_t maxlocs[WIDTH * HEIGHT];
-        size_t maxprob = 0, maxlocn = 0;
+        write_observation(out_json, "obs_real", step.sim.obs_real);
+        write_observation(out_json, "obs_observed", step.sim.obs_observed);
+        const belief_summary &summary = loc.summary;
         // also log probabilities to json
         out_json << "\"probability\":[";
-        for (point lpt = {{0}}; lpt.p[1] < HEIGHT; next_point(lpt)) {
-            uint32_t prob = loc.probability[point_index(lpt)];
-            if (lpt.p[0] != 0 || lpt.p[1] != 0) out_json << ",";
-            out_json << prob;
-            if (prob > maxprob) {
-                maxlocn = 0;
-                maxlocs[maxlocn++] = point_index(lpt);
-                maxprob = prob;
-            } else if (prob == maxprob) {
-                maxlocs[maxlocn++] = point_index(lpt);
-            }
+        for (size_t q = 0; q < WIDTH * HEIGHT; q++) {
+            if (q) out_json << ",";
+            out_json << loc.probability[q];
         }
         out_json << "]";
         // print summary
-        std::printf("max probability: %.12f\n", maxprob / (double)((uint64_t)1 << 32));
-        std::printf("occurs in %llu locations:\n", maxlocn);
-        if (maxlocn > 5) maxlocn = 5;
+        std::printf("max probability: %.12f\n", summary.maxprob / (double)((uint64_t)1 << 32));
+        std::printf("occurs in %llu locations:\n", summary.maxlocn);
+        belief_cell maxlocs[TOP_K];
+        size_t maxlocn = most_likely_cells(loc, std::min(summary.maxlocn, TOP_K), maxlocs, nullptr);
         bool correct = false;
         for (size_t i = 0; i < maxlocn; i++) {
-            point p = from_index(maxlocs[i]);
+            point p = from_index(maxlocs[i].index);
             if (p == pt) correct = true;
             std::printf("  (%d, %d)\n", p.p[0], p.p[1]);
         }
         if (!correct) {
             std::printf("|||||> FAILURE!\n");
         }
-        std::printf("||> END OF MOVEMENT %llu\n", index + 1);
+        std::printf("||> END OF MOVEMENT %llu\n", step.sim.index + 1);
         std::fflush(stdout);
         out_json << "}";
+        stats->items++;
     }
     out_json << "]}";
+    stats->total_ns = elapsed_ns(start);
+}
+
+int main(int argc, char **argv) {
+    locator loc = {{0}};
+    size_t nspaces = 0;
+    for (size_t a = 0; a < WIDTH * HEIGHT; a++) if (!is_wall(from_index(a), map)) nspaces++;
+    uint32_t prob = ((uint64_t)1 << 32) / nspaces;
+    for (size_t a = 0; a < WIDTH * HEIGHT; a++) {
+        loc.probability[a] = prob;
+        loc.summary.active[a] = (unsigned short)a;
+    }
+    loc.summary.support = WIDTH * HEIGHT;
+    kernel_planner planner;
+    planner_init(&planner, map, DEFAULT_THRESHOLDS);
+    if (argc > 1 && std::string(argv[1]) == "--calibrate") {
+        calibrate(planner, map);
+        return 0;
+    }
+    load_thresholds(&planner.thresholds);
+    std::printf("probability: %.12f\n", loc.probability[0] / (double)((uint64_t)1 << 32));
+    std::fflush(stdout);
+    // direction movements[] = {EAST, EAST, EAST, EAST, EAST, SOUTH, SOUTH, WEST, WEST, WEST, SOUTH, WEST, WEST, NORTH};
+    size_t num_movements = 100;
+    // each stage runs on its own thread; the rings give backpressure so the simulator can only run PIPELINE_DEPTH steps ahead
+    static spsc_ring<sim_step, PIPELINE_DEPTH> observations;
+    static spsc_ring<belief_step, PIPELINE_DEPTH> beliefs;
+    ring_init(&observations);
+    ring_init(&beliefs);
+    stage_stats stats[3] = {{"simulate"}, {"filter"}, {"write"}};
+    std::ofstream out_json("robot.json");
+    std::thread simulator(simulate_stage, num_movements, &observations, &stats[0]);
+    std::thread filter(filter_stage, &planner, std::cref(loc), &observations, &beliefs, &stats[1]);
+    std::thread writer(serialize_stage, std::ref(out_json), &beliefs, &stats[2]);
+    simulator.join();
+    filter.join();
+    writer.join();
+    print_stage_stats(stats, 3);
+    print_planner_stats(planner);
     return 0;
 }